@@ -31,11 +31,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <GL/glxext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #ifndef GLX_MESA_swap_control
 #define GLX_MESA_swap_control 1
@@ -66,6 +75,21 @@ current_time(void)
    return (double) tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
+/* return resident set size of this process (in kB), 0 if unknown */
+static long
+current_rss_kb(void)
+{
+   long pages = 0;
+   FILE *f = fopen("/proc/self/statm", "r");
+
+   if (f) {
+      if (fscanf(f, "%*s %ld", &pages) != 1)
+         pages = 0;
+      fclose(f);
+   }
+   return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 #else /*BENCHMARK*/
 
 /* dummy */
@@ -82,6 +106,13 @@ current_time(void)
    return t += 1.0;
 }
 
+/* dummy */
+static long
+current_rss_kb(void)
+{
+   return 0;
+}
+
 #endif /*BENCHMARK*/
 
 
@@ -96,10 +127,39 @@ current_time(void)
 #define EXIT 1
 #define DRAW 2
 
+/** Set by SIGINT/SIGTERM, so the event loops can shut down cleanly. */
+static volatile sig_atomic_t quit_requested = 0;
+
+static void
+request_quit(int sig)
+{
+   (void) sig;
+   quit_requested = 1;
+}
+
 static GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
-static GLint gear1, gear2, gear3;
 static GLfloat angle = 0.0;
 
+#define NUM_GEARS 3
+
+/** Shape, color and placement of each gear. */
+static const struct {
+   GLfloat inner_radius, outer_radius, width;
+   GLint teeth;
+   GLfloat tooth_depth;
+   GLfloat color[4];
+   GLfloat x, y;		/* Position. */
+   GLfloat rate, phase;		/* Rotation is rate * angle + phase. */
+} gear_desc[NUM_GEARS] = {
+   { 1.0, 4.0, 1.0, 20, 0.7, { 0.8, 0.1, 0.0, 1.0 }, -3.0, -2.0,  1.0,   0.0 },
+   { 0.5, 2.0, 2.0, 10, 0.7, { 0.0, 0.8, 0.2, 1.0 },  3.1, -2.0, -2.0,  -9.0 },
+   { 1.3, 2.0, 0.5, 10, 0.7, { 0.2, 0.2, 1.0, 1.0 }, -3.1,  4.2, -2.0, -25.0 }
+};
+
+static GLuint gears[NUM_GEARS];
+
+#define VIEW_DISTANCE 40.0	/* Eye to scene center, set up by reshape(). */
+
 static GLboolean fullscreen = GL_FALSE;	/* Create a single fullscreen window */
 static GLboolean stereo = GL_FALSE;	/* Enable stereo.  */
 static GLint samples = 0;               /* Choose visual with at least N samples. */
@@ -107,6 +167,333 @@ static GLboolean animate = GL_TRUE;	/* Animation */
 static GLfloat eyesep = 5.0;		/* Eye separation. */
 static GLfloat fix_point = 40.0;	/* Fixation point distance.  */
 static GLfloat left, right, asp;	/* Stereo frustum params.  */
+static GLfloat target_ms = 0.0;		/* Dynamic resolution target frame time, 0 = off. */
+static GLint num_windows = 1;		/* Windows sharing one context. */
+static GLint max_inflight = 0;		/* Max frames queued on the GPU, 0 = driver's choice. */
+static GLboolean stream = GL_FALSE;	/* Stream gear transforms through a buffer. */
+static GLboolean compact = GL_FALSE;	/* Draw gears from quantized vertex buffers. */
+static const char *metrics_path = NULL;	/* Unix socket to serve statistics on. */
+static GLboolean hud = GL_FALSE;	/* Draw statistics over the gears. */
+
+
+typedef void (*glproc)(void);
+
+/**
+ * Window system backend.  Everything that talks to X/GLX or EGL goes
+ * through one of these, so the drawing code doesn't care which is in use.
+ */
+struct backend {
+   const char *name;
+   /** Connect to the window system, return 0 on failure. */
+   int (*open)(const char *dpyName);
+   /** Create the drawable and make a context current on it. */
+   void (*make_current_window)(const char *name, int x, int y,
+                               unsigned int *width, unsigned int *height);
+   /** Make the context current on window i of num_windows. */
+   void (*bind_window)(int i);
+   void (*query_vsync)(void);
+   void (*print_info)(void);
+   glproc (*get_proc_address)(const char *name);
+   /** Swap all windows. */
+   void (*swap_buffers)(void);
+   void (*event_loop)(void);
+   void (*close)(void);
+};
+
+static const struct backend *backend;
+
+#define GET_PROC(type, name) ((type) backend->get_proc_address(name))
+
+
+/**
+ * Determine whether or not an extension is in a space-separated list.
+ */
+static int
+is_extension_in_string(const char *extensions, const char *query)
+{
+   const size_t len = strlen(query);
+   const char *ptr;
+
+   if (extensions == NULL)
+      return 0;
+
+   ptr = strstr(extensions, query);
+   return ((ptr != NULL) && ((ptr[len] == ' ') || (ptr[len] == '\0')));
+}
+
+
+/**
+ * Determine whether or not a GL extension is supported.
+ */
+static int
+is_gl_extension_supported(const char *query)
+{
+   return is_extension_in_string((const char *) glGetString(GL_EXTENSIONS),
+                                 query);
+}
+
+
+static PFNGLFENCESYNCPROC pglFenceSync;
+static PFNGLCLIENTWAITSYNCPROC pglClientWaitSync;
+static PFNGLDELETESYNCPROC pglDeleteSync;
+
+/**
+ * Look up the GL_ARB_sync entry points.
+ * \return 0 if sync objects aren't supported
+ */
+static int
+init_sync(void)
+{
+   if (!is_gl_extension_supported("GL_ARB_sync"))
+      return 0;
+
+   pglFenceSync = GET_PROC(PFNGLFENCESYNCPROC, "glFenceSync");
+   pglClientWaitSync = GET_PROC(PFNGLCLIENTWAITSYNCPROC, "glClientWaitSync");
+   pglDeleteSync = GET_PROC(PFNGLDELETESYNCPROC, "glDeleteSync");
+   return 1;
+}
+
+
+/**
+ * Block until a fence has signalled.
+ */
+static void
+wait_sync(GLsync sync)
+{
+   while (pglClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+                            1000000000) == GL_TIMEOUT_EXPIRED)
+      ;
+}
+
+
+static PFNGLCREATESHADERPROC pglCreateShader;
+static PFNGLSHADERSOURCEPROC pglShaderSource;
+static PFNGLCOMPILESHADERPROC pglCompileShader;
+static PFNGLDELETESHADERPROC pglDeleteShader;
+static PFNGLCREATEPROGRAMPROC pglCreateProgram;
+static PFNGLATTACHSHADERPROC pglAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC pglBindAttribLocation;
+static PFNGLLINKPROGRAMPROC pglLinkProgram;
+static PFNGLGETPROGRAMIVPROC pglGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC pglGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC pglUseProgram;
+static PFNGLDELETEPROGRAMPROC pglDeleteProgram;
+static PFNGLGENBUFFERSPROC pglGenBuffers;
+static PFNGLDELETEBUFFERSPROC pglDeleteBuffers;
+static PFNGLBINDBUFFERPROC pglBindBuffer;
+static PFNGLBUFFERDATAPROC pglBufferData;
+
+/**
+ * Look up the GLSL and buffer object entry points.
+ */
+static void
+init_shader_procs(void)
+{
+   pglCreateShader = GET_PROC(PFNGLCREATESHADERPROC, "glCreateShader");
+   pglShaderSource = GET_PROC(PFNGLSHADERSOURCEPROC, "glShaderSource");
+   pglCompileShader = GET_PROC(PFNGLCOMPILESHADERPROC, "glCompileShader");
+   pglDeleteShader = GET_PROC(PFNGLDELETESHADERPROC, "glDeleteShader");
+   pglCreateProgram = GET_PROC(PFNGLCREATEPROGRAMPROC, "glCreateProgram");
+   pglAttachShader = GET_PROC(PFNGLATTACHSHADERPROC, "glAttachShader");
+   pglBindAttribLocation = GET_PROC(PFNGLBINDATTRIBLOCATIONPROC,
+                                    "glBindAttribLocation");
+   pglLinkProgram = GET_PROC(PFNGLLINKPROGRAMPROC, "glLinkProgram");
+   pglGetProgramiv = GET_PROC(PFNGLGETPROGRAMIVPROC, "glGetProgramiv");
+   pglGetProgramInfoLog = GET_PROC(PFNGLGETPROGRAMINFOLOGPROC,
+                                   "glGetProgramInfoLog");
+   pglUseProgram = GET_PROC(PFNGLUSEPROGRAMPROC, "glUseProgram");
+   pglDeleteProgram = GET_PROC(PFNGLDELETEPROGRAMPROC, "glDeleteProgram");
+   pglGenBuffers = GET_PROC(PFNGLGENBUFFERSPROC, "glGenBuffers");
+   pglDeleteBuffers = GET_PROC(PFNGLDELETEBUFFERSPROC, "glDeleteBuffers");
+   pglBindBuffer = GET_PROC(PFNGLBINDBUFFERPROC, "glBindBuffer");
+   pglBufferData = GET_PROC(PFNGLBUFFERDATAPROC, "glBufferData");
+}
+
+
+static GLuint
+compile_shader(GLenum type, const char *src)
+{
+   GLuint sh = pglCreateShader(type);
+
+   pglShaderSource(sh, 1, &src, NULL);
+   pglCompileShader(sh);
+   return sh;
+}
+
+
+/**
+ * Create a program from vertex and fragment shader source.  Attribute
+ * locations can still be bound before link_program().
+ */
+static GLuint
+create_program(const char *vert_src, const char *frag_src)
+{
+   GLuint prog = pglCreateProgram();
+   GLuint vs = compile_shader(GL_VERTEX_SHADER, vert_src);
+   GLuint fs = compile_shader(GL_FRAGMENT_SHADER, frag_src);
+
+   pglAttachShader(prog, vs);
+   pglAttachShader(prog, fs);
+   pglDeleteShader(vs);
+   pglDeleteShader(fs);
+   return prog;
+}
+
+
+/**
+ * Link a program, deleting it and complaining on failure.
+ * \return 0 if linking failed
+ */
+static int
+link_program(GLuint prog, const char *option)
+{
+   GLint ok;
+
+   pglLinkProgram(prog);
+   pglGetProgramiv(prog, GL_LINK_STATUS, &ok);
+   if (!ok) {
+      char log[1000];
+
+      pglGetProgramInfoLog(prog, sizeof(log), NULL, log);
+      printf("Warning: couldn't build shader, %s ignored:\n%s\n",
+             option, log);
+      pglDeleteProgram(prog);
+   }
+   return ok;
+}
+
+
+
+/*
+ * Mesh capture.  gear() goes through these instead of calling GL directly.
+ * Normally they just pass through, but while mesh_capture is set they
+ * collect the gear as a list of triangles instead.  Flat shading is baked
+ * in the way GL would do it: every vertex of a flat shaded quad gets the
+ * normal of the quad's last (provoking) vertex.
+ */
+struct mesh_vertex {
+   GLfloat pos[3];
+   GLfloat normal[3];
+};
+
+static GLboolean mesh_capture = GL_FALSE;
+static GLboolean mesh_flat;
+static GLenum mesh_mode;
+static GLfloat mesh_normal[3];
+static struct mesh_vertex *mesh_prim;	/* Vertices of the current glBegin(). */
+static int mesh_prim_count, mesh_prim_size;
+static struct mesh_vertex *mesh_tris;	/* Captured triangles. */
+static int mesh_tri_count, mesh_tri_size;	/* In vertices. */
+static int mesh_emitted;		/* Vertices gear() emitted. */
+
+
+static void
+mesh_append(struct mesh_vertex **array, int *count, int *size,
+            const struct mesh_vertex *v)
+{
+   if (*count == *size) {
+      *size = *size ? *size * 2 : 256;
+      *array = realloc(*array, *size * sizeof(**array));
+      if (!*array) {
+         printf("Error: out of memory\n");
+         exit(1);
+      }
+   }
+   (*array)[(*count)++] = *v;
+}
+
+
+/**
+ * Append quad v0 v1 v2 v3 (in polygon order) of the current primitive as
+ * two triangles.
+ */
+static void
+mesh_quad(int v0, int v1, int v2, int v3, int provoking)
+{
+   const int idx[6] = { v0, v1, v2, v0, v2, v3 };
+   int i;
+
+   for (i = 0; i < 6; i++) {
+      struct mesh_vertex v = mesh_prim[idx[i]];
+
+      if (mesh_flat)
+         memcpy(v.normal, mesh_prim[provoking].normal, sizeof(v.normal));
+      mesh_append(&mesh_tris, &mesh_tri_count, &mesh_tri_size, &v);
+   }
+}
+
+
+static void
+gear_shade_model(GLenum mode)
+{
+   if (mesh_capture)
+      mesh_flat = (mode == GL_FLAT);
+   else
+      glShadeModel(mode);
+}
+
+static void
+gear_begin(GLenum mode)
+{
+   if (mesh_capture) {
+      mesh_mode = mode;
+      mesh_prim_count = 0;
+   }
+   else {
+      glBegin(mode);
+   }
+}
+
+static void
+gear_normal(GLfloat x, GLfloat y, GLfloat z)
+{
+   if (mesh_capture) {
+      mesh_normal[0] = x;
+      mesh_normal[1] = y;
+      mesh_normal[2] = z;
+   }
+   else {
+      glNormal3f(x, y, z);
+   }
+}
+
+static void
+gear_vertex(GLfloat x, GLfloat y, GLfloat z)
+{
+   if (mesh_capture) {
+      struct mesh_vertex v;
+
+      v.pos[0] = x;
+      v.pos[1] = y;
+      v.pos[2] = z;
+      memcpy(v.normal, mesh_normal, sizeof(v.normal));
+      mesh_append(&mesh_prim, &mesh_prim_count, &mesh_prim_size, &v);
+      mesh_emitted++;
+   }
+   else {
+      glVertex3f(x, y, z);
+   }
+}
+
+static void
+gear_end(void)
+{
+   int i;
+
+   if (!mesh_capture) {
+      glEnd();
+      return;
+   }
+
+   if (mesh_mode == GL_QUAD_STRIP) {
+      for (i = 0; i + 3 < mesh_prim_count; i += 2)
+         mesh_quad(i, i + 1, i + 3, i + 2, i + 3);
+   }
+   else if (mesh_mode == GL_QUADS) {
+      for (i = 0; i + 3 < mesh_prim_count; i += 4)
+         mesh_quad(i, i + 1, i + 2, i + 3, i + 3);
+   }
+}
 
 
 /*
@@ -135,197 +522,1569 @@ gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
 
    da = 2.0 * M_PI / teeth / 4.0;
 
-   glShadeModel(GL_FLAT);
+   gear_shade_model(GL_FLAT);
 
-   glNormal3f(0.0, 0.0, 1.0);
+   gear_normal(0.0, 0.0, 1.0);
 
    /* draw front face */
-   glBegin(GL_QUAD_STRIP);
+   gear_begin(GL_QUAD_STRIP);
    for (i = 0; i <= teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
+      gear_vertex(r0 * cos(angle), r0 * sin(angle), width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), width * 0.5);
       if (i < teeth) {
-	 glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
-	 glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		    width * 0.5);
+	 gear_vertex(r0 * cos(angle), r0 * sin(angle), width * 0.5);
+	 gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		     width * 0.5);
       }
    }
-   glEnd();
+   gear_end();
 
    /* draw front sides of teeth */
-   glBegin(GL_QUADS);
+   gear_begin(GL_QUADS);
    da = 2.0 * M_PI / teeth / 4.0;
    for (i = 0; i < teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
 
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 width * 0.5);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), width * 0.5);
+      gear_vertex(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
+      gear_vertex(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
+		  width * 0.5);
+      gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		  width * 0.5);
    }
-   glEnd();
+   gear_end();
 
-   glNormal3f(0.0, 0.0, -1.0);
+   gear_normal(0.0, 0.0, -1.0);
 
    /* draw back face */
-   glBegin(GL_QUAD_STRIP);
+   gear_begin(GL_QUAD_STRIP);
    for (i = 0; i <= teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
+      gear_vertex(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
       if (i < teeth) {
-	 glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		    -width * 0.5);
-	 glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
+	 gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		     -width * 0.5);
+	 gear_vertex(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
       }
    }
-   glEnd();
+   gear_end();
 
    /* draw back sides of teeth */
-   glBegin(GL_QUADS);
+   gear_begin(GL_QUADS);
    da = 2.0 * M_PI / teeth / 4.0;
    for (i = 0; i < teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
 
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 -width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 -width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
+      gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		  -width * 0.5);
+      gear_vertex(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
+		  -width * 0.5);
+      gear_vertex(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
    }
-   glEnd();
+   gear_end();
 
    /* draw outward faces of teeth */
-   glBegin(GL_QUAD_STRIP);
+   gear_begin(GL_QUAD_STRIP);
    for (i = 0; i < teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
 
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5);
-      glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), width * 0.5);
+      gear_vertex(r1 * cos(angle), r1 * sin(angle), -width * 0.5);
       u = r2 * cos(angle + da) - r1 * cos(angle);
       v = r2 * sin(angle + da) - r1 * sin(angle);
       len = sqrt(u * u + v * v);
       u /= len;
       v /= len;
-      glNormal3f(v, -u, 0.0);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
-      glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
-      glNormal3f(cos(angle), sin(angle), 0.0);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 width * 0.5);
-      glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
-		 -width * 0.5);
+      gear_normal(v, -u, 0.0);
+      gear_vertex(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5);
+      gear_vertex(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5);
+      gear_normal(cos(angle), sin(angle), 0.0);
+      gear_vertex(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
+		  width * 0.5);
+      gear_vertex(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da),
+		  -width * 0.5);
       u = r1 * cos(angle + 3 * da) - r2 * cos(angle + 2 * da);
       v = r1 * sin(angle + 3 * da) - r2 * sin(angle + 2 * da);
-      glNormal3f(v, -u, 0.0);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 width * 0.5);
-      glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
-		 -width * 0.5);
-      glNormal3f(cos(angle), sin(angle), 0.0);
+      gear_normal(v, -u, 0.0);
+      gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		  width * 0.5);
+      gear_vertex(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da),
+		  -width * 0.5);
+      gear_normal(cos(angle), sin(angle), 0.0);
    }
 
-   glVertex3f(r1 * cos(0), r1 * sin(0), width * 0.5);
-   glVertex3f(r1 * cos(0), r1 * sin(0), -width * 0.5);
+   gear_vertex(r1 * cos(0), r1 * sin(0), width * 0.5);
+   gear_vertex(r1 * cos(0), r1 * sin(0), -width * 0.5);
 
-   glEnd();
+   gear_end();
 
-   glShadeModel(GL_SMOOTH);
+   gear_shade_model(GL_SMOOTH);
 
    /* draw inside radius cylinder */
-   glBegin(GL_QUAD_STRIP);
+   gear_begin(GL_QUAD_STRIP);
    for (i = 0; i <= teeth; i++) {
       angle = i * 2.0 * M_PI / teeth;
-      glNormal3f(-cos(angle), -sin(angle), 0.0);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
-      glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5);
+      gear_normal(-cos(angle), -sin(angle), 0.0);
+      gear_vertex(r0 * cos(angle), r0 * sin(angle), -width * 0.5);
+      gear_vertex(r0 * cos(angle), r0 * sin(angle), width * 0.5);
    }
-   glEnd();
+   gear_end();
 }
 
 
+/*
+ * Compact gear meshes.  With -compact each gear is captured from gear()
+ * once and stored in a vertex buffer at 8 bytes per vertex: positions are
+ * quantized to 16 bits within the gear's bounding box and normals are
+ * octahedral encoded into two signed bytes.  Identical vertices are merged
+ * and the gear is drawn with 16-bit indices.  A small shader decodes both
+ * and does the fixed function lighting.
+ *
+ * Merging doesn't make the mesh smaller: with flat shading baked in, a
+ * corner shared by two faces needs one vertex per face normal, so a gear
+ * ends up with a few more unique vertices than gear() emits.  All of the
+ * saving comes from the 8-byte vertex format, and it isn't lossless: the
+ * 8-bit normals shift lighting by one step on some pixels.
+ */
+struct compact_vertex {
+   GLushort pos[3];		/* Normalized within the gear's bounds. */
+   GLbyte normal[2];		/* Octahedral encoding. */
+};
+
+static struct {
+   GLint first_vertex, first_index, num_indices;
+   GLfloat scale[3], bias[3];	/* pos = bias + scale * normalized pos */
+} compact_gears[NUM_GEARS];
+
+static struct compact_vertex *compact_verts;
+static GLushort *compact_indices;
+static int compact_vert_count, compact_index_count;
+
+static GLuint compact_prog, compact_vbo, compact_ibo;
+static GLint compact_scale_loc, compact_bias_loc;
+
+static PFNGLGETUNIFORMLOCATIONPROC pglGetUniformLocation;
+static PFNGLUNIFORM3FVPROC pglUniform3fv;
+static PFNGLVERTEXATTRIBPOINTERPROC pglVertexAttribPointer;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC pglEnableVertexAttribArray;
+static PFNGLDISABLEVERTEXATTRIBARRAYPROC pglDisableVertexAttribArray;
+
+static const char *compact_vert_src =
+   "#version 120\n"
+   "uniform vec3 pos_scale, pos_bias;\n"
+   "attribute vec3 position;\n"
+   "attribute vec2 oct_normal;\n"
+   "vec3 oct_decode(vec2 e)\n"
+   "{\n"
+   "   vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+   "   if (n.z < 0.0)\n"
+   "      n.xy = (1.0 - abs(n.yx)) *\n"
+   "             vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+   "   return normalize(n);\n"
+   "}\n"
+   "void main()\n"
+   "{\n"
+   "   vec3 n = normalize(gl_NormalMatrix * oct_decode(oct_normal));\n"
+   "   vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+   "   gl_FrontColor = gl_FrontLightModelProduct.sceneColor +\n"
+   "                   gl_FrontLightProduct[0].ambient +\n"
+   "                   gl_FrontLightProduct[0].diffuse * max(dot(n, l), 0.0);\n"
+   "   gl_Position = gl_ModelViewProjectionMatrix *\n"
+   "                 vec4(pos_bias + pos_scale * position, 1.0);\n"
+   "}\n";
+
+static const char *compact_frag_src =
+   "#version 120\n"
+   "void main()\n"
+   "{\n"
+   "   gl_FragColor = gl_Color;\n"
+   "}\n";
+
+
+/** Encode a unit normal into two signed bytes, octahedral mapping */
 static void
-draw(void)
+oct_encode(const GLfloat *n, GLbyte *out)
 {
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   GLfloat l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+   GLfloat x = n[0] / l1, y = n[1] / l1;
 
-   glPushMatrix();
-   glRotatef(view_rotx, 1.0, 0.0, 0.0);
-   glRotatef(view_roty, 0.0, 1.0, 0.0);
-   glRotatef(view_rotz, 0.0, 0.0, 1.0);
+   if (n[2] < 0.0) {
+      GLfloat ox = x;
+
+      x = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+      y = (1.0 - fabs(ox)) * (y >= 0.0 ? 1.0 : -1.0);
+   }
+   out[0] = (GLbyte) (x * 127.0 + (x >= 0.0 ? 0.5 : -0.5));
+   out[1] = (GLbyte) (y * 127.0 + (y >= 0.0 ? 0.5 : -0.5));
+}
+
+
+/**
+ * Index of v among the vertices of the gear being built, adding it if it's
+ * new.  hash is an open addressing table of hash_size (a power of two)
+ * entries holding vertex numbers relative to first, or -1.
+ */
+static int
+compact_lookup(const struct compact_vertex *v, int first,
+               int *hash, int hash_size)
+{
+   const unsigned char *b = (const unsigned char *) v;
+   unsigned h = 2166136261u;
+   unsigned i;
+
+   for (i = 0; i < sizeof(*v); i++)
+      h = (h ^ b[i]) * 16777619u;
+
+   for (i = h & (hash_size - 1); hash[i] >= 0; i = (i + 1) & (hash_size - 1)) {
+      if (memcmp(&compact_verts[first + hash[i]], v, sizeof(*v)) == 0)
+         return hash[i];
+   }
+
+   hash[i] = compact_vert_count - first;
+   compact_verts[compact_vert_count++] = *v;
+   return hash[i];
+}
+
+
+/**
+ * Capture gear n from gear() and append it to the compact arrays.
+ */
+static void
+compact_add_gear(int n)
+{
+   GLfloat lo[3], hi[3];
+   int *hash, hash_size = 1;
+   int first = compact_vert_count;
+   int i, j, bytes;
+
+   mesh_capture = GL_TRUE;
+   mesh_tri_count = mesh_emitted = 0;
+   gear(gear_desc[n].inner_radius, gear_desc[n].outer_radius,
+        gear_desc[n].width, gear_desc[n].teeth, gear_desc[n].tooth_depth);
+   mesh_capture = GL_FALSE;
+
+   for (j = 0; j < 3; j++) {
+      lo[j] = hi[j] = mesh_tris[0].pos[j];
+      for (i = 1; i < mesh_tri_count; i++) {
+         if (mesh_tris[i].pos[j] < lo[j])
+            lo[j] = mesh_tris[i].pos[j];
+         if (mesh_tris[i].pos[j] > hi[j])
+            hi[j] = mesh_tris[i].pos[j];
+      }
+      compact_gears[n].bias[j] = lo[j];
+      compact_gears[n].scale[j] = hi[j] - lo[j];
+   }
+
+   /* worst case every vertex is distinct */
+   compact_verts = realloc(compact_verts, (compact_vert_count + mesh_tri_count)
+                           * sizeof(*compact_verts));
+   compact_indices = realloc(compact_indices,
+                             (compact_index_count + mesh_tri_count)
+                             * sizeof(*compact_indices));
+   while (hash_size < 2 * mesh_tri_count)
+      hash_size *= 2;
+   hash = malloc(hash_size * sizeof(*hash));
+   if (!compact_verts || !compact_indices || !hash) {
+      printf("Error: out of memory\n");
+      exit(1);
+   }
+   for (i = 0; i < hash_size; i++)
+      hash[i] = -1;
+
+   compact_gears[n].first_vertex = first;
+   compact_gears[n].first_index = compact_index_count;
+
+   for (i = 0; i + 2 < mesh_tri_count; i += 3) {
+      int tri[3], k;
+
+      for (k = 0; k < 3; k++) {
+         const struct mesh_vertex *mv = &mesh_tris[i + k];
+         struct compact_vertex cv;
+
+         for (j = 0; j < 3; j++) {
+            GLfloat range = compact_gears[n].scale[j];
+            GLfloat t = range > 0.0 ? (mv->pos[j] - lo[j]) / range : 0.0;
+
+            cv.pos[j] = (GLushort) (t * 65535.0 + 0.5);
+         }
+         oct_encode(mv->normal, cv.normal);
+         tri[k] = compact_lookup(&cv, first, hash, hash_size);
+      }
+
+      /* quad strips have zero area quads, which merge away */
+      if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2])
+         continue;
+
+      for (k = 0; k < 3; k++)
+         compact_indices[compact_index_count++] = tri[k];
+   }
+   free(hash);
+
+   if (compact_vert_count - first > 65536) {
+      printf("Error: gear %d has too many vertices for 16-bit indices\n", n);
+      exit(1);
+   }
+
+   compact_gears[n].num_indices =
+      compact_index_count - compact_gears[n].first_index;
+
+   bytes = (compact_vert_count - first) * sizeof(struct compact_vertex) +
+           compact_gears[n].num_indices * sizeof(GLushort);
+   printf("Gear %d: %d bytes as %d float vertices, %d bytes compact "
+          "(%d quantized vertices at %d bytes, %d indices)\n",
+          n, mesh_emitted * 6 * (int) sizeof(GLfloat), mesh_emitted,
+          bytes, compact_vert_count - first,
+          (int) sizeof(struct compact_vertex), compact_gears[n].num_indices);
+}
+
+
+/**
+ * Build the decode shader.  Turns -compact off again if the driver can't
+ * do it.
+ */
+static void
+compact_init(void)
+{
+   if (!is_gl_extension_supported("GL_ARB_vertex_buffer_object") ||
+       !is_gl_extension_supported("GL_ARB_vertex_shader")) {
+      printf("Warning: vertex buffers or shaders not supported, "
+             "-compact ignored\n");
+      compact = GL_FALSE;
+      return;
+   }
+
+   if (stream) {
+      printf("Warning: -stream is not supported with -compact\n");
+      stream = GL_FALSE;
+   }
+
+   init_shader_procs();
+   pglGetUniformLocation = GET_PROC(PFNGLGETUNIFORMLOCATIONPROC,
+                                    "glGetUniformLocation");
+   pglUniform3fv = GET_PROC(PFNGLUNIFORM3FVPROC, "glUniform3fv");
+   pglVertexAttribPointer = GET_PROC(PFNGLVERTEXATTRIBPOINTERPROC,
+                                     "glVertexAttribPointer");
+   pglEnableVertexAttribArray = GET_PROC(PFNGLENABLEVERTEXATTRIBARRAYPROC,
+                                         "glEnableVertexAttribArray");
+   pglDisableVertexAttribArray = GET_PROC(PFNGLDISABLEVERTEXATTRIBARRAYPROC,
+                                          "glDisableVertexAttribArray");
+
+   compact_prog = create_program(compact_vert_src, compact_frag_src);
+   pglBindAttribLocation(compact_prog, 0, "position");
+   pglBindAttribLocation(compact_prog, 1, "oct_normal");
+   if (!link_program(compact_prog, "-compact")) {
+      compact = GL_FALSE;
+      return;
+   }
+   compact_scale_loc = pglGetUniformLocation(compact_prog, "pos_scale");
+   compact_bias_loc = pglGetUniformLocation(compact_prog, "pos_bias");
+}
+
+
+/**
+ * Upload the gears built by compact_add_gear().
+ */
+static void
+compact_upload(void)
+{
+   pglGenBuffers(1, &compact_vbo);
+   pglBindBuffer(GL_ARRAY_BUFFER, compact_vbo);
+   pglBufferData(GL_ARRAY_BUFFER,
+                 compact_vert_count * sizeof(struct compact_vertex),
+                 compact_verts, GL_STATIC_DRAW);
+   pglBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   pglGenBuffers(1, &compact_ibo);
+   pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, compact_ibo);
+   pglBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 compact_index_count * sizeof(GLushort),
+                 compact_indices, GL_STATIC_DRAW);
+   pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+   free(compact_verts);
+   free(compact_indices);
+   free(mesh_prim);
+   free(mesh_tris);
+   compact_verts = NULL;
+   compact_indices = NULL;
+   mesh_prim = mesh_tris = NULL;
+   mesh_prim_size = mesh_tri_size = 0;
+}
+
+
+static void
+compact_begin(void)
+{
+   pglUseProgram(compact_prog);
+   pglBindBuffer(GL_ARRAY_BUFFER, compact_vbo);
+   pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, compact_ibo);
+   pglEnableVertexAttribArray(0);
+   pglEnableVertexAttribArray(1);
+}
+
+
+static void
+draw_compact_gear(int n)
+{
+   const GLsizei stride = sizeof(struct compact_vertex);
+   const GLintptr base = compact_gears[n].first_vertex * stride;
+
+   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, gear_desc[n].color);
+   pglUniform3fv(compact_scale_loc, 1, compact_gears[n].scale);
+   pglUniform3fv(compact_bias_loc, 1, compact_gears[n].bias);
+   pglVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride,
+                          (const GLvoid *) base);
+   pglVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, stride,
+                          (const GLvoid *) (base + 3 * sizeof(GLushort)));
+   glDrawElements(GL_TRIANGLES, compact_gears[n].num_indices,
+                  GL_UNSIGNED_SHORT,
+                  (const GLvoid *) (compact_gears[n].first_index
+                                    * sizeof(GLushort)));
+}
+
+
+static void
+compact_end(void)
+{
+   pglDisableVertexAttribArray(0);
+   pglDisableVertexAttribArray(1);
+   pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   pglBindBuffer(GL_ARRAY_BUFFER, 0);
+   pglUseProgram(0);
+}
+
+
+static void
+compact_fini(void)
+{
+   pglDeleteBuffers(1, &compact_vbo);
+   pglDeleteBuffers(1, &compact_ibo);
+   pglDeleteProgram(compact_prog);
+}
+
+
+/** m = m * b, for 4x4 column-major matrices */
+static void
+mat4_multiply(GLfloat *m, const GLfloat *b)
+{
+   GLfloat r[16];
+   int i, j;
+
+   for (i = 0; i < 4; i++) {
+      for (j = 0; j < 4; j++) {
+         r[i * 4 + j] = m[j] * b[i * 4] + m[4 + j] * b[i * 4 + 1] +
+                        m[8 + j] * b[i * 4 + 2] + m[12 + j] * b[i * 4 + 3];
+      }
+   }
+   memcpy(m, r, sizeof(r));
+}
+
+/** m = m * rotation, like glRotatef() with a unit axis */
+static void
+mat4_rotate(GLfloat *m, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+   GLfloat r[16];
+   GLfloat s = sin(angle * M_PI / 180.0);
+   GLfloat c = cos(angle * M_PI / 180.0);
+   GLfloat t = 1.0 - c;
+
+   r[0] = x * x * t + c;
+   r[1] = y * x * t + z * s;
+   r[2] = x * z * t - y * s;
+   r[3] = 0.0;
+   r[4] = x * y * t - z * s;
+   r[5] = y * y * t + c;
+   r[6] = y * z * t + x * s;
+   r[7] = 0.0;
+   r[8] = x * z * t + y * s;
+   r[9] = y * z * t - x * s;
+   r[10] = z * z * t + c;
+   r[11] = 0.0;
+   r[12] = r[13] = r[14] = 0.0;
+   r[15] = 1.0;
+   mat4_multiply(m, r);
+}
+
+/** m = m * translation, like glTranslatef() */
+static void
+mat4_translate(GLfloat *m, GLfloat x, GLfloat y, GLfloat z)
+{
+   int j;
+
+   for (j = 0; j < 4; j++)
+      m[12 + j] += m[j] * x + m[4 + j] * y + m[8 + j] * z;
+}
+
+/**
+ * The modelview matrix draw() starts from: what reshape() loads, plus
+ * draw_gears()' stereo eye offset.  Kept on the CPU so the streaming path
+ * never has to read the matrix back from GL.
+ */
+static void
+mat4_view(GLfloat *m, GLfloat eye_x)
+{
+   static const GLfloat identity[16] = {
+      1.0, 0.0, 0.0, 0.0,
+      0.0, 1.0, 0.0, 0.0,
+      0.0, 0.0, 1.0, 0.0,
+      0.0, 0.0, 0.0, 1.0
+   };
+
+   memcpy(m, identity, sizeof(identity));
+   mat4_translate(m, 0.0, 0.0, -VIEW_DISTANCE);
+   mat4_translate(m, eye_x, 0.0, 0.0);
+}
+
+
+/*
+ * Transform streaming.  With -stream the modelview matrix of every gear is
+ * computed on the CPU and written into a uniform buffer, and a small
+ * shader doing the same lighting as the fixed function pipeline picks each
+ * gear's matrix by an index recorded in its display list.  A draw() is
+ * then one glBindBufferRange() and one glCallLists() no matter how many
+ * gears there are.
+ *
+ * With GL_ARB_buffer_storage the buffer is a persistently mapped ring of
+ * STREAM_SLOTS frames, each fenced once the frame is submitted, so nothing
+ * is ever mapped or unmapped.  Without it the buffer is orphaned every
+ * frame and filled with glBufferSubData.
+ */
+#define STREAM_SLOTS 3
+#define GEAR_INDEX_ATTRIB 6	/* Not aliased with any fixed function attrib. */
+
+#define STRINGIFY(x) #x
+#define XSTRINGIFY(x) STRINGIFY(x)
+
+static const char *stream_vert_src =
+   "#version 150 compatibility\n"
+   "uniform Gears {\n"
+   "   mat4 modelview[" XSTRINGIFY(NUM_GEARS) "];\n"
+   "};\n"
+   "in float gear_index;\n"
+   "void main()\n"
+   "{\n"
+   "   mat4 mv = modelview[int(gear_index)];\n"
+   "   vec3 n = normalize(mat3(mv) * gl_Normal);\n"
+   "   vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+   "   gl_FrontColor = gl_FrontLightModelProduct.sceneColor +\n"
+   "                   gl_FrontLightProduct[0].ambient +\n"
+   "                   gl_FrontLightProduct[0].diffuse * max(dot(n, l), 0.0);\n"
+   "   gl_Position = gl_ProjectionMatrix * (mv * gl_Vertex);\n"
+   "}\n";
+
+static const char *stream_frag_src =
+   "#version 150 compatibility\n"
+   "void main()\n"
+   "{\n"
+   "   gl_FragColor = gl_Color;\n"
+   "}\n";
+
+static GLuint stream_prog, stream_ubo;
+static GLboolean stream_persistent;
+static GLubyte *stream_map;		/* Persistent mapping of the whole ring. */
+static GLsizeiptr stream_block;		/* Bytes per draw(), aligned. */
+static GLsizeiptr stream_slot_size;	/* Bytes per frame. */
+static GLsync stream_fence[STREAM_SLOTS];
+static int stream_slot;
+static GLintptr stream_offset;		/* Next free byte in the current slot. */
+
+static PFNGLVERTEXATTRIB1FPROC pglVertexAttrib1f;
+static PFNGLGETUNIFORMBLOCKINDEXPROC pglGetUniformBlockIndex;
+static PFNGLUNIFORMBLOCKBINDINGPROC pglUniformBlockBinding;
+static PFNGLBINDBUFFERRANGEPROC pglBindBufferRange;
+static PFNGLBUFFERSUBDATAPROC pglBufferSubData;
+static PFNGLBUFFERSTORAGEPROC pglBufferStorage;
+static PFNGLMAPBUFFERRANGEPROC pglMapBufferRange;
+static PFNGLUNMAPBUFFERPROC pglUnmapBuffer;
+
+
+/**
+ * Build the shader and the uniform buffer.  Must run before init() so the
+ * display lists get their gear index.  Turns streaming off again if the
+ * driver can't do it.
+ */
+static void
+stream_init(void)
+{
+   GLint align, draws;
+
+   if (!is_gl_extension_supported("GL_ARB_uniform_buffer_object")) {
+      printf("Warning: GL_ARB_uniform_buffer_object not supported, "
+             "-stream ignored\n");
+      stream = GL_FALSE;
+      return;
+   }
+
+   init_shader_procs();
+   pglVertexAttrib1f = GET_PROC(PFNGLVERTEXATTRIB1FPROC, "glVertexAttrib1f");
+   pglGetUniformBlockIndex = GET_PROC(PFNGLGETUNIFORMBLOCKINDEXPROC,
+                                      "glGetUniformBlockIndex");
+   pglUniformBlockBinding = GET_PROC(PFNGLUNIFORMBLOCKBINDINGPROC,
+                                     "glUniformBlockBinding");
+   pglBindBufferRange = GET_PROC(PFNGLBINDBUFFERRANGEPROC,
+                                 "glBindBufferRange");
+   pglBufferSubData = GET_PROC(PFNGLBUFFERSUBDATAPROC, "glBufferSubData");
+   pglBufferStorage = GET_PROC(PFNGLBUFFERSTORAGEPROC, "glBufferStorage");
+   pglMapBufferRange = GET_PROC(PFNGLMAPBUFFERRANGEPROC, "glMapBufferRange");
+   pglUnmapBuffer = GET_PROC(PFNGLUNMAPBUFFERPROC, "glUnmapBuffer");
+
+   stream_prog = create_program(stream_vert_src, stream_frag_src);
+   pglBindAttribLocation(stream_prog, GEAR_INDEX_ATTRIB, "gear_index");
+   if (!link_program(stream_prog, "-stream")) {
+      stream = GL_FALSE;
+      return;
+   }
+   pglUniformBlockBinding(stream_prog,
+                          pglGetUniformBlockIndex(stream_prog, "Gears"), 0);
+
+   /* draw() runs once per eye and window each frame */
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+   stream_block = (NUM_GEARS * 16 * sizeof(GLfloat) + align - 1) / align * align;
+   draws = (stereo ? 2 : 1) * num_windows;
+   stream_slot_size = stream_block * draws;
+
+   pglGenBuffers(1, &stream_ubo);
+   pglBindBuffer(GL_UNIFORM_BUFFER, stream_ubo);
+
+   stream_persistent = is_gl_extension_supported("GL_ARB_buffer_storage") &&
+                       init_sync();
+   if (stream_persistent) {
+      const GLbitfield flags =
+         GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+      pglBufferStorage(GL_UNIFORM_BUFFER, stream_slot_size * STREAM_SLOTS,
+                       NULL, flags);
+      stream_map = pglMapBufferRange(GL_UNIFORM_BUFFER, 0,
+                                     stream_slot_size * STREAM_SLOTS, flags);
+      if (!stream_map) {
+         printf("Warning: couldn't map the stream buffer, "
+                "streaming with glBufferSubData\n");
+         /* storage from glBufferStorage is immutable, start over */
+         pglDeleteBuffers(1, &stream_ubo);
+         pglGenBuffers(1, &stream_ubo);
+         pglBindBuffer(GL_UNIFORM_BUFFER, stream_ubo);
+         stream_persistent = GL_FALSE;
+      }
+   }
+   else {
+      printf("Warning: GL_ARB_buffer_storage not supported, "
+             "streaming with glBufferSubData\n");
+   }
+}
+
+
+/**
+ * Start a new frame's worth of matrices.
+ */
+static void
+stream_begin_frame(void)
+{
+   if (stream_persistent) {
+      /* the GPU may still be reading the slot three frames back */
+      if (stream_fence[stream_slot]) {
+         wait_sync(stream_fence[stream_slot]);
+         pglDeleteSync(stream_fence[stream_slot]);
+         stream_fence[stream_slot] = 0;
+      }
+   }
+   else {
+      pglBindBuffer(GL_UNIFORM_BUFFER, stream_ubo);
+      pglBufferData(GL_UNIFORM_BUFFER, stream_slot_size, NULL,
+                    GL_STREAM_DRAW);
+   }
+   stream_offset = 0;
+}
+
+
+/**
+ * Called after SwapBuffers: fence the slot just used and move on.
+ */
+static void
+stream_end_frame(void)
+{
+   if (stream_persistent) {
+      stream_fence[stream_slot] =
+         pglFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      stream_slot = (stream_slot + 1) % STREAM_SLOTS;
+   }
+}
+
+
+/**
+ * Draw all gears with one call, taking their transforms from the buffer.
+ * base is the modelview matrix to start from, see mat4_view().
+ */
+static void
+draw_streamed(const GLfloat *base)
+{
+   GLfloat view[16], m[NUM_GEARS][16];
+   GLintptr offset;
+   int i;
+
+   memcpy(view, base, sizeof(view));
+   mat4_rotate(view, view_rotx, 1.0, 0.0, 0.0);
+   mat4_rotate(view, view_roty, 0.0, 1.0, 0.0);
+   mat4_rotate(view, view_rotz, 0.0, 0.0, 1.0);
+
+   for (i = 0; i < NUM_GEARS; i++) {
+      memcpy(m[i], view, sizeof(view));
+      mat4_translate(m[i], gear_desc[i].x, gear_desc[i].y, 0.0);
+      mat4_rotate(m[i], gear_desc[i].rate * angle + gear_desc[i].phase,
+                  0.0, 0.0, 1.0);
+   }
+
+   if (stream_persistent) {
+      offset = stream_slot * stream_slot_size + stream_offset;
+      memcpy(stream_map + offset, m, sizeof(m));
+   }
+   else {
+      offset = stream_offset;
+      pglBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(m), m);
+   }
+   stream_offset += stream_block;
+
+   pglBindBufferRange(GL_UNIFORM_BUFFER, 0, stream_ubo, offset, sizeof(m));
+   pglUseProgram(stream_prog);
+   glCallLists(NUM_GEARS, GL_UNSIGNED_INT, gears);
+   pglUseProgram(0);
+}
+
+
+static void
+stream_fini(void)
+{
+   int i;
+
+   for (i = 0; i < STREAM_SLOTS; i++) {
+      if (stream_fence[i])
+         pglDeleteSync(stream_fence[i]);
+   }
+   if (stream_persistent) {
+      pglBindBuffer(GL_UNIFORM_BUFFER, stream_ubo);
+      pglUnmapBuffer(GL_UNIFORM_BUFFER);
+   }
+   pglDeleteBuffers(1, &stream_ubo);
+   pglDeleteProgram(stream_prog);
+}
+
+
+/**
+ * Draw the scene.  view is the current modelview matrix, which only the
+ * streaming path needs; everything else uses GL's matrix stack.
+ */
+static void
+draw(const GLfloat *view)
+{
+   int i;
+
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   if (stream) {
+      draw_streamed(view);
+      return;
+   }
+
+   glPushMatrix();
+   glRotatef(view_rotx, 1.0, 0.0, 0.0);
+   glRotatef(view_roty, 0.0, 1.0, 0.0);
+   glRotatef(view_rotz, 0.0, 0.0, 1.0);
+
+   if (compact)
+      compact_begin();
+
+   for (i = 0; i < NUM_GEARS; i++) {
+      glPushMatrix();
+      glTranslatef(gear_desc[i].x, gear_desc[i].y, 0.0);
+      glRotatef(gear_desc[i].rate * angle + gear_desc[i].phase,
+                0.0, 0.0, 1.0);
+      if (compact)
+         draw_compact_gear(i);
+      else
+         glCallList(gears[i]);
+      glPopMatrix();
+   }
+
+   if (compact)
+      compact_end();
+
+   glPopMatrix();
+}
+
+
+static void
+draw_gears(void)
+{
+   GLfloat view[16];
+
+   if (stereo) {
+      /* First left eye.  */
+      glDrawBuffer(GL_BACK_LEFT);
+
+      glMatrixMode(GL_PROJECTION);
+      glLoadIdentity();
+      glFrustum(left, right, -asp, asp, 5.0, 60.0);
+
+      glMatrixMode(GL_MODELVIEW);
+
+      glPushMatrix();
+      glTranslated(+0.5 * eyesep, 0.0, 0.0);
+      mat4_view(view, +0.5 * eyesep);
+      draw(view);
+      glPopMatrix();
+
+      /* Then right eye.  */
+      glDrawBuffer(GL_BACK_RIGHT);
+
+      glMatrixMode(GL_PROJECTION);
+      glLoadIdentity();
+      glFrustum(-right, -left, -asp, asp, 5.0, 60.0);
+
+      glMatrixMode(GL_MODELVIEW);
+
+      glPushMatrix();
+      glTranslated(-0.5 * eyesep, 0.0, 0.0);
+      mat4_view(view, -0.5 * eyesep);
+      draw(view);
+      glPopMatrix();
+   }
+   else {
+      mat4_view(view, 0.0);
+      draw(view);
+   }
+}
+
+
+/*
+ * Dynamic resolution scaling.  The scene is rendered into an offscreen
+ * framebuffer at res_scale times the window size and stretched onto the
+ * window with glBlitFramebuffer.  The renderbuffers are always allocated
+ * at the full window size and only the viewport shrinks, so changing the
+ * scale from one frame to the next costs nothing.  At full scale the
+ * offscreen buffer would only add a blit, so then we draw to the window.
+ */
+#define DYNRES_MIN_SCALE 0.25
+#define DYNRES_HOLD_FRAMES 15	/* Frames to wait after a scale change. */
+
+static GLfloat res_scale = 1.0;
+static GLboolean dynres_given_up = GL_FALSE;	/* Scaling didn't help. */
+static int win_width, win_height;
+static GLuint dynres_fbo, dynres_rb[2];
+
+static PFNGLGENFRAMEBUFFERSPROC pglGenFramebuffers;
+static PFNGLDELETEFRAMEBUFFERSPROC pglDeleteFramebuffers;
+static PFNGLBINDFRAMEBUFFERPROC pglBindFramebuffer;
+static PFNGLFRAMEBUFFERRENDERBUFFERPROC pglFramebufferRenderbuffer;
+static PFNGLCHECKFRAMEBUFFERSTATUSPROC pglCheckFramebufferStatus;
+static PFNGLGENRENDERBUFFERSPROC pglGenRenderbuffers;
+static PFNGLDELETERENDERBUFFERSPROC pglDeleteRenderbuffers;
+static PFNGLBINDRENDERBUFFERPROC pglBindRenderbuffer;
+static PFNGLRENDERBUFFERSTORAGEPROC pglRenderbufferStorage;
+static PFNGLBLITFRAMEBUFFERPROC pglBlitFramebuffer;
+
+/**
+ * Set up the offscreen framebuffer.  Turns dynamic resolution off again
+ * if the driver lacks framebuffer objects or the visual can't take a blit.
+ */
+static void
+dynres_init(void)
+{
+   if (stereo || samples > 0 || num_windows > 1) {
+      printf("Warning: -target-ms is not supported with -stereo, -samples "
+             "or -windows\n");
+      target_ms = 0.0;
+      return;
+   }
+
+   if (!is_gl_extension_supported("GL_ARB_framebuffer_object")) {
+      printf("Warning: GL_ARB_framebuffer_object not supported, "
+             "dynamic resolution disabled\n");
+      target_ms = 0.0;
+      return;
+   }
+
+   pglGenFramebuffers = GET_PROC(PFNGLGENFRAMEBUFFERSPROC,
+                                 "glGenFramebuffers");
+   pglDeleteFramebuffers = GET_PROC(PFNGLDELETEFRAMEBUFFERSPROC,
+                                    "glDeleteFramebuffers");
+   pglBindFramebuffer = GET_PROC(PFNGLBINDFRAMEBUFFERPROC,
+                                 "glBindFramebuffer");
+   pglFramebufferRenderbuffer = GET_PROC(PFNGLFRAMEBUFFERRENDERBUFFERPROC,
+                                         "glFramebufferRenderbuffer");
+   pglCheckFramebufferStatus = GET_PROC(PFNGLCHECKFRAMEBUFFERSTATUSPROC,
+                                        "glCheckFramebufferStatus");
+   pglGenRenderbuffers = GET_PROC(PFNGLGENRENDERBUFFERSPROC,
+                                  "glGenRenderbuffers");
+   pglDeleteRenderbuffers = GET_PROC(PFNGLDELETERENDERBUFFERSPROC,
+                                     "glDeleteRenderbuffers");
+   pglBindRenderbuffer = GET_PROC(PFNGLBINDRENDERBUFFERPROC,
+                                  "glBindRenderbuffer");
+   pglRenderbufferStorage = GET_PROC(PFNGLRENDERBUFFERSTORAGEPROC,
+                                     "glRenderbufferStorage");
+   pglBlitFramebuffer = GET_PROC(PFNGLBLITFRAMEBUFFERPROC,
+                                 "glBlitFramebuffer");
+
+   pglGenFramebuffers(1, &dynres_fbo);
+   pglGenRenderbuffers(2, dynres_rb);
+}
+
+
+/**
+ * (Re)allocate the offscreen color and depth buffers at window size.
+ */
+static void
+dynres_resize(int width, int height)
+{
+   GLenum status;
+
+   pglBindRenderbuffer(GL_RENDERBUFFER, dynres_rb[0]);
+   pglRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+   pglBindRenderbuffer(GL_RENDERBUFFER, dynres_rb[1]);
+   pglRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24,
+                          width, height);
+   pglBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+   pglBindFramebuffer(GL_FRAMEBUFFER, dynres_fbo);
+   pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, dynres_rb[0]);
+   pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, dynres_rb[1]);
+   status = pglCheckFramebufferStatus(GL_FRAMEBUFFER);
+   pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+   if (status != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Error: dynamic resolution framebuffer incomplete (0x%x)\n",
+             status);
+      exit(1);
+   }
+}
+
+
+/**
+ * Pick the render scale for the next frame from the measured frame time.
+ * The scale drops quickly when we're over budget but only creeps back up
+ * once we're well under it, and every change is followed by a hold-off
+ * period, so the scale doesn't oscillate around the target.  If a lower
+ * scale didn't make frames faster (fill isn't the bottleneck, or the blit
+ * costs more than it saves, as on software renderers) we go back to full
+ * scale and stay there.
+ */
+static void
+dynres_update(double dt)
+{
+   static double avg_ms = -1.0;
+   static double shrink_ms = -1.0;	/* avg_ms before the last scale-down */
+   static int hold = 0;
+   double ms = dt * 1000.0;
+
+   if (ms <= 0.0 || dynres_given_up)
+      return;
+
+   if (avg_ms < 0.0)
+      avg_ms = ms;
+   else
+      avg_ms = 0.8 * avg_ms + 0.2 * ms;
+
+   if (hold > 0) {
+      hold--;
+      return;
+   }
+
+   if (avg_ms > target_ms * 1.1 && shrink_ms > 0.0 && avg_ms >= shrink_ms) {
+      printf("Warning: lower resolution didn't lower the frame time "
+             "(%.2f ms before, %.2f ms at scale %.2f), "
+             "dynamic resolution disabled\n", shrink_ms, avg_ms, res_scale);
+      res_scale = 1.0;
+      dynres_given_up = GL_TRUE;
+      return;
+   }
+   else if (avg_ms > target_ms * 1.1 && res_scale > DYNRES_MIN_SCALE) {
+      /* fill cost goes with the pixel count, i.e. with scale squared */
+      shrink_ms = avg_ms;
+      res_scale *= sqrt(target_ms / avg_ms);
+      if (res_scale < DYNRES_MIN_SCALE)
+         res_scale = DYNRES_MIN_SCALE;
+   }
+   else if (avg_ms < target_ms * 0.8 && res_scale < 1.0) {
+      shrink_ms = -1.0;
+      res_scale += 0.05;
+      if (res_scale > 1.0)
+         res_scale = 1.0;
+   }
+   else {
+      return;
+   }
+
+   hold = DYNRES_HOLD_FRAMES;
+}
+
+
+static void
+dynres_begin(void)
+{
+   GLint w = (GLint) (win_width * res_scale);
+   GLint h = (GLint) (win_height * res_scale);
+
+   if (res_scale >= 1.0) {
+      glViewport(0, 0, win_width, win_height);
+      return;
+   }
+
+   pglBindFramebuffer(GL_FRAMEBUFFER, dynres_fbo);
+   glViewport(0, 0, w, h);
+   /* keep glClear() to the part of the buffer we actually use */
+   glScissor(0, 0, w, h);
+   glEnable(GL_SCISSOR_TEST);
+}
+
+
+static void
+dynres_end(void)
+{
+   GLint w = (GLint) (win_width * res_scale);
+   GLint h = (GLint) (win_height * res_scale);
+
+   if (res_scale >= 1.0)
+      return;
+
+   /* the scissor test applies to blits, too */
+   glDisable(GL_SCISSOR_TEST);
+
+   pglBindFramebuffer(GL_READ_FRAMEBUFFER, dynres_fbo);
+   pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+   pglBlitFramebuffer(0, 0, w, h, 0, 0, win_width, win_height,
+                      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+   pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+static void
+dynres_fini(void)
+{
+   pglDeleteFramebuffers(1, &dynres_fbo);
+   pglDeleteRenderbuffers(2, dynres_rb);
+}
+
+
+/*
+ * Frame pacing.  With -max-inflight N a fence goes into the command stream
+ * after every swap and no more than N frames are allowed to be outstanding
+ * at any time, rather than leaving the queue depth up to the driver.
+ * The time from the start of a frame to its completion is its latency.
+ */
+#define MAX_INFLIGHT 16
+
+static GLsync inflight_fence[MAX_INFLIGHT];
+static double inflight_submit[MAX_INFLIGHT];
+static int inflight_head, inflight_count;
+
+/* statistics since the last report */
+static int inflight_retired;
+static double inflight_latency, inflight_wait;
+
+static void
+inflight_init(void)
+{
+   if (!init_sync()) {
+      printf("Warning: GL_ARB_sync not supported, -max-inflight ignored\n");
+      max_inflight = 0;
+      return;
+   }
+
+   if (max_inflight > MAX_INFLIGHT)
+      max_inflight = MAX_INFLIGHT;
+}
+
+
+/**
+ * Retire the oldest outstanding frame, waiting for it if block is set.
+ * \return 1 if a frame was retired, 0 if it hasn't completed yet
+ */
+static int
+inflight_retire(int block)
+{
+   int tail = (inflight_head + MAX_INFLIGHT - inflight_count) % MAX_INFLIGHT;
+   GLenum ret;
+
+   if (block) {
+      wait_sync(inflight_fence[tail]);
+   }
+   else {
+      ret = pglClientWaitSync(inflight_fence[tail], 0, 0);
+      if (ret == GL_TIMEOUT_EXPIRED)
+         return 0;
+   }
+
+   inflight_latency += current_time() - inflight_submit[tail];
+   inflight_retired++;
+
+   pglDeleteSync(inflight_fence[tail]);
+   inflight_count--;
+   return 1;
+}
+
+
+/**
+ * Called before drawing a frame: wait until fewer than max_inflight frames
+ * are outstanding.
+ */
+static void
+inflight_throttle(void)
+{
+   double t0;
+
+   while (inflight_count > 0 && inflight_retire(0))
+      ;
+
+   if (inflight_count < max_inflight)
+      return;
+
+   t0 = current_time();
+   while (inflight_count >= max_inflight)
+      inflight_retire(1);
+   inflight_wait += current_time() - t0;
+}
+
+
+/**
+ * Called after SwapBuffers: fence the frame just submitted.  start is
+ * when the frame began to be drawn, so the latency includes the time
+ * spent recording it, which a deeper queue hides.
+ */
+static void
+inflight_fence_frame(double start)
+{
+   inflight_fence[inflight_head] =
+      pglFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   /* the non-blocking poll in inflight_retire() doesn't flush, and an
+    * unflushed fence may never be seen to signal
+    */
+   glFlush();
+   inflight_submit[inflight_head] = start;
+   inflight_head = (inflight_head + 1) % MAX_INFLIGHT;
+   inflight_count++;
+}
+
+
+static void
+inflight_fini(void)
+{
+   while (inflight_count > 0)
+      inflight_retire(1);
+}
+
+
+/*
+ * Runtime statistics, for the -metrics socket and the -hud overlay.
+ *
+ * The render thread is the only writer.  Each frame it stores its frame
+ * time, from the start of the frame until its swap returns, into a ring and bumps some counters with atomic stores, and never
+ * takes a lock, so a scrape can't stall rendering.  Readers copy the ring
+ * after loading the frame count; an entry overwritten while being copied
+ * just means the snapshot includes a slightly newer frame.  Idle time
+ * between frames (paused, or waiting for an Expose) isn't counted.
+ */
+#define METRICS_FRAMES 1024
+
+static struct {
+   unsigned int frame_us[METRICS_FRAMES];	/* Recent frame times. */
+   unsigned long frames;			/* Also the ring position. */
+   unsigned long long frame_us_total;
+   unsigned long long swap_us_total;
+   unsigned long gears_drawn;
+   unsigned long gears_culled;
+} metrics;
+
+struct metrics_summary {
+   unsigned long frames;
+   double p50, p90, p99, max, mean;	/* Over recent frames, in seconds. */
+   double frame_time_total, swap_wait_total;
+   unsigned long gears_drawn, gears_culled;
+};
+
+static int metrics_fd = -1;
+static pthread_t metrics_tid;
+static struct stat metrics_sock_stat;	/* The socket we bound, to remove it. */
+
+
+/**
+ * Account for one frame.  Render thread only.
+ */
+static void
+metrics_record(double frame_time, double swap_wait, unsigned long drawn)
+{
+   unsigned long n = metrics.frames;
+   unsigned int us = (unsigned int) (frame_time * 1000000.0);
+
+   __atomic_store_n(&metrics.frame_us[n % METRICS_FRAMES], us,
+                    __ATOMIC_RELAXED);
+   __atomic_store_n(&metrics.frame_us_total, metrics.frame_us_total + us,
+                    __ATOMIC_RELAXED);
+   __atomic_store_n(&metrics.swap_us_total, metrics.swap_us_total +
+                    (unsigned long long) (swap_wait * 1000000.0),
+                    __ATOMIC_RELAXED);
+   /* nothing is culled yet; every gear drawn is counted */
+   __atomic_store_n(&metrics.gears_drawn, metrics.gears_drawn + drawn,
+                    __ATOMIC_RELAXED);
+   __atomic_store_n(&metrics.frames, n + 1, __ATOMIC_RELEASE);
+}
+
+
+static int
+compare_uint(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Take a snapshot of the statistics.  Safe from any thread.
+ */
+static void
+metrics_summarize(struct metrics_summary *sum)
+{
+   unsigned int recent[METRICS_FRAMES];
+   unsigned long n, i;
+   double total = 0.0;
+
+   memset(sum, 0, sizeof(*sum));
+   sum->frames = n = __atomic_load_n(&metrics.frames, __ATOMIC_ACQUIRE);
+   sum->frame_time_total =
+      __atomic_load_n(&metrics.frame_us_total, __ATOMIC_RELAXED) / 1e6;
+   sum->swap_wait_total =
+      __atomic_load_n(&metrics.swap_us_total, __ATOMIC_RELAXED) / 1e6;
+   sum->gears_drawn = __atomic_load_n(&metrics.gears_drawn, __ATOMIC_RELAXED);
+   sum->gears_culled = __atomic_load_n(&metrics.gears_culled,
+                                       __ATOMIC_RELAXED);
+
+   if (n > METRICS_FRAMES)
+      n = METRICS_FRAMES;
+   if (n == 0)
+      return;
+
+   for (i = 0; i < n; i++) {
+      recent[i] = __atomic_load_n(&metrics.frame_us[i], __ATOMIC_RELAXED);
+      total += recent[i];
+   }
+   qsort(recent, n, sizeof(recent[0]), compare_uint);
+
+   sum->p50 = recent[n * 50 / 100] / 1e6;
+   sum->p90 = recent[n * 90 / 100] / 1e6;
+   sum->p99 = recent[n * 99 / 100] / 1e6;
+   sum->max = recent[n - 1] / 1e6;
+   sum->mean = total / n / 1e6;
+}
+
+
+/**
+ * Write the statistics to a client in Prometheus text format.  Scrapers
+ * speaking HTTP (curl --unix-socket) get a response header, anything
+ * else (nc -U) just gets the text.
+ */
+static void
+metrics_serve(int fd)
+{
+   struct metrics_summary sum;
+   struct pollfd pfd;
+   char req[256], body[2048], head[128];
+   int len, head_len = 0;
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   if (poll(&pfd, 1, 100) > 0) {
+      ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+
+      if (n >= 4 && strncmp(req, "GET ", 4) == 0)
+         head_len = 1;
+   }
+
+   metrics_summarize(&sum);
+   len = snprintf(body, sizeof(body),
+      "# HELP glxgears_frame_time_seconds Busy time per frame, start to swap, over the last %d frames.\n"
+      "# TYPE glxgears_frame_time_seconds summary\n"
+      "glxgears_frame_time_seconds{quantile=\"0.5\"} %g\n"
+      "glxgears_frame_time_seconds{quantile=\"0.9\"} %g\n"
+      "glxgears_frame_time_seconds{quantile=\"0.99\"} %g\n"
+      "glxgears_frame_time_seconds{quantile=\"1\"} %g\n"
+      "glxgears_frame_time_seconds_sum %g\n"
+      "glxgears_frame_time_seconds_count %lu\n"
+      "# HELP glxgears_swap_wait_seconds_total Time spent in SwapBuffers.\n"
+      "# TYPE glxgears_swap_wait_seconds_total counter\n"
+      "glxgears_swap_wait_seconds_total %g\n"
+      "# HELP glxgears_gears_drawn_total Gears drawn.\n"
+      "# TYPE glxgears_gears_drawn_total counter\n"
+      "glxgears_gears_drawn_total %lu\n"
+      "# HELP glxgears_gears_culled_total Gears skipped as not visible.\n"
+      "# TYPE glxgears_gears_culled_total counter\n"
+      "glxgears_gears_culled_total %lu\n"
+      "# HELP glxgears_resident_memory_bytes Resident set size.\n"
+      "# TYPE glxgears_resident_memory_bytes gauge\n"
+      "glxgears_resident_memory_bytes %ld\n",
+      METRICS_FRAMES, sum.p50, sum.p90, sum.p99, sum.max,
+      sum.frame_time_total, sum.frames, sum.swap_wait_total,
+      sum.gears_drawn, sum.gears_culled, current_rss_kb() * 1024);
+
+   if (head_len) {
+      head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %d\r\n\r\n", len);
+      send(fd, head, head_len, MSG_NOSIGNAL);
+   }
+   send(fd, body, len, MSG_NOSIGNAL);
+}
+
+
+static void *
+metrics_thread(void *arg)
+{
+   (void) arg;
+
+   while (1) {
+      int fd = accept(metrics_fd, NULL, NULL);
+
+      if (fd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+             errno == ENOMEM) {
+            /* out of descriptors or memory, give the process a moment */
+            usleep(100000);
+            continue;
+         }
+         /* EINVAL once metrics_fini() shut the socket down, or
+          * anything else we can't recover from
+          */
+         break;
+      }
+      metrics_serve(fd);
+      close(fd);
+   }
+   return NULL;
+}
+
+
+/**
+ * Start serving statistics on metrics_path.
+ */
+static void
+metrics_init(void)
+{
+   struct sockaddr_un addr;
+
+   if (strlen(metrics_path) >= sizeof(addr.sun_path)) {
+      printf("Error: socket path %s is too long\n", metrics_path);
+      exit(1);
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, metrics_path);
+
+   /* a stale socket from a previous run would make bind() fail, but
+    * never remove anything that isn't a socket
+    */
+   if (lstat(metrics_path, &metrics_sock_stat) == 0) {
+      if (!S_ISSOCK(metrics_sock_stat.st_mode)) {
+         printf("Error: %s exists and is not a socket\n", metrics_path);
+         exit(1);
+      }
+      unlink(metrics_path);
+   }
+
+   metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (metrics_fd < 0 ||
+       bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+       listen(metrics_fd, 4) < 0 ||
+       lstat(metrics_path, &metrics_sock_stat) < 0) {
+      perror(metrics_path);
+      exit(1);
+   }
+
+   if (pthread_create(&metrics_tid, NULL, metrics_thread, NULL) != 0) {
+      printf("Error: couldn't start metrics thread\n");
+      exit(1);
+   }
+}
+
+
+static void
+metrics_fini(void)
+{
+   struct stat st;
+
+   /* close() alone doesn't wake a thread blocked in accept(), and the fd
+    * number could be reused under it; shutdown() makes accept() fail
+    */
+   shutdown(metrics_fd, SHUT_RDWR);
+   pthread_join(metrics_tid, NULL);
+   close(metrics_fd);
+
+   /* only remove the path if it's still the socket we bound */
+   if (lstat(metrics_path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+       st.st_dev == metrics_sock_stat.st_dev &&
+       st.st_ino == metrics_sock_stat.st_ino)
+      unlink(metrics_path);
+}
+
+
+/*
+ * The -hud overlay.  The text is rendered into a 1 bit per pixel image on
+ * the CPU with a built-in 5x7 font and drawn with a single glBitmap(), so
+ * it works the same with every backend and costs one call per frame.
+ */
+#define HUD_SCALE 2
+#define HUD_LINES 4
+#define HUD_COLUMNS 24
+
+static const char hud_chars[] = "0123456789.:ABEFGKMPRSW";
+static const unsigned char hud_font[][7] = {
+   { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },	/* 0 */
+   { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },	/* 1 */
+   { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },	/* 2 */
+   { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },	/* 3 */
+   { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },	/* 4 */
+   { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },	/* 5 */
+   { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },	/* 6 */
+   { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },	/* 7 */
+   { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },	/* 8 */
+   { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },	/* 9 */
+   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },	/* . */
+   { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },	/* : */
+   { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },	/* A */
+   { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },	/* B */
+   { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },	/* E */
+   { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },	/* F */
+   { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },	/* G */
+   { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },	/* K */
+   { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },	/* M */
+   { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },	/* P */
+   { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },	/* R */
+   { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },	/* S */
+   { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }	/* W */
+};
+
+#define HUD_WIDTH (HUD_COLUMNS * 6 * HUD_SCALE)
+#define HUD_HEIGHT (HUD_LINES * 9 * HUD_SCALE)
+#define HUD_STRIDE ((HUD_WIDTH + 7) / 8)
+
+static GLubyte hud_bits[HUD_HEIGHT * HUD_STRIDE];
+
+
+/**
+ * Render one line of text into hud_bits.  Line 0 is at the top.
+ */
+static void
+hud_print(int line, const char *text)
+{
+   int col, row, x, y;
+
+   for (col = 0; col < HUD_COLUMNS && text[col]; col++) {
+      const char *c = strchr(hud_chars, text[col]);
 
-   glPushMatrix();
-   glTranslatef(-3.0, -2.0, 0.0);
-   glRotatef(angle, 0.0, 0.0, 1.0);
-   glCallList(gear1);
-   glPopMatrix();
+      if (!c)
+         continue;
 
-   glPushMatrix();
-   glTranslatef(3.1, -2.0, 0.0);
-   glRotatef(-2.0 * angle - 9.0, 0.0, 0.0, 1.0);
-   glCallList(gear2);
-   glPopMatrix();
+      for (row = 0; row < 7; row++) {
+         const unsigned char bits = hud_font[c - hud_chars][row];
 
-   glPushMatrix();
-   glTranslatef(-3.1, 4.2, 0.0);
-   glRotatef(-2.0 * angle - 25.0, 0.0, 0.0, 1.0);
-   glCallList(gear3);
-   glPopMatrix();
+         for (x = 0; x < 5 * HUD_SCALE; x++) {
+            int px = (col * 6 + 1) * HUD_SCALE + x;
 
-   glPopMatrix();
+            if (!(bits & (0x10 >> (x / HUD_SCALE))))
+               continue;
+
+            /* glBitmap rows go bottom to top */
+            for (y = 0; y < HUD_SCALE; y++) {
+               int py = HUD_HEIGHT - 1 -
+                        ((line * 9 + 1 + row) * HUD_SCALE + y);
+
+               hud_bits[py * HUD_STRIDE + px / 8] |= 0x80 >> (px % 8);
+            }
+         }
+      }
+   }
 }
 
 
+/**
+ * Redraw the overlay text from the current statistics.
+ */
 static void
-draw_gears(void)
+hud_update(void)
 {
-   if (stereo) {
-      /* First left eye.  */
-      glDrawBuffer(GL_BACK_LEFT);
-
-      glMatrixMode(GL_PROJECTION);
-      glLoadIdentity();
-      glFrustum(left, right, -asp, asp, 5.0, 60.0);
+   struct metrics_summary sum;
+   char text[HUD_LINES][64];
+   int i;
 
-      glMatrixMode(GL_MODELVIEW);
+   metrics_summarize(&sum);
+
+   snprintf(text[0], sizeof(text[0]), "FPS %.1f",
+            sum.mean > 0.0 ? 1.0 / sum.mean : 0.0);
+   snprintf(text[1], sizeof(text[1]), "P50 %.2f P99 %.2f MS",
+            sum.p50 * 1000.0, sum.p99 * 1000.0);
+   snprintf(text[2], sizeof(text[2]), "SWAP %.2f MS",
+            sum.frames ? sum.swap_wait_total * 1000.0 / sum.frames : 0.0);
+   snprintf(text[3], sizeof(text[3]), "GEARS %lu RSS %ld KB",
+            sum.frames ? sum.gears_drawn / sum.frames : 0,
+            current_rss_kb());
+
+   memset(hud_bits, 0, sizeof(hud_bits));
+   for (i = 0; i < HUD_LINES; i++)
+      hud_print(i, text[i]);
+}
 
-      glPushMatrix();
-      glTranslated(+0.5 * eyesep, 0.0, 0.0);
-      draw();
-      glPopMatrix();
 
-      /* Then right eye.  */
-      glDrawBuffer(GL_BACK_RIGHT);
+static void
+hud_draw(void)
+{
+   glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT);
+   glDisable(GL_LIGHTING);
+   glDisable(GL_DEPTH_TEST);
+   if (stereo)
+      glDrawBuffer(GL_BACK);
 
-      glMatrixMode(GL_PROJECTION);
-      glLoadIdentity();
-      glFrustum(-right, -left, -asp, asp, 5.0, 60.0);
+   glMatrixMode(GL_PROJECTION);
+   glPushMatrix();
+   glLoadIdentity();
+   glMatrixMode(GL_MODELVIEW);
+   glPushMatrix();
+   glLoadIdentity();
 
-      glMatrixMode(GL_MODELVIEW);
+   /* bottom left corner, with a small margin */
+   glColor3f(1.0, 1.0, 1.0);
+   glRasterPos2f(-1.0, -1.0);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   glBitmap(HUD_WIDTH, HUD_HEIGHT, -4.0, -4.0, 0.0, 0.0, hud_bits);
 
-      glPushMatrix();
-      glTranslated(-0.5 * eyesep, 0.0, 0.0);
-      draw();
-      glPopMatrix();
-   }
-   else {
-      draw();
-   }
+   glPopMatrix();
+   glMatrixMode(GL_PROJECTION);
+   glPopMatrix();
+   glMatrixMode(GL_MODELVIEW);
+   glPopAttrib();
 }
 
 
 /** Draw single frame, do SwapBuffers, compute FPS */
 static void
-draw_frame(Display *dpy, Window win)
+draw_frame(void)
 {
    static int frames = 0;
-   static double tRot0 = -1.0, tRate0 = -1.0;
-   double dt, t = current_time();
+   static double tRot0 = -1.0, tRate0 = -1.0, tHud0 = -1.0;
+   static long rss_one_window = 0;
+   double dt, t, tSwap;
+   int i;
+
+   if (max_inflight > 0)
+      inflight_throttle();
+   if (stream)
+      stream_begin_frame();
 
+   t = current_time();
    if (tRot0 < 0.0)
       tRot0 = t;
    dt = t - tRot0;
@@ -336,10 +2095,58 @@ draw_frame(Display *dpy, Window win)
       angle += 70.0 * dt;  /* 70 degrees per second */
       if (angle > 3600.0)
          angle -= 3600.0;
+
+      if (target_ms > 0.0)
+         dynres_update(dt);
+   }
+
+   if (target_ms > 0.0) {
+      dynres_begin();
+      draw_gears();
+      dynres_end();
+   }
+   else if (num_windows > 1) {
+      /* one context, drawn into every window in turn, swapped together */
+      for (i = 0; i < num_windows; i++) {
+         backend->bind_window(i);
+         draw_gears();
+         if (i == 0 && rss_one_window == 0) {
+            /* what a single-window process needs, once its first frame
+             * is done, as a baseline for N separate processes
+             */
+            glFinish();
+            rss_one_window = current_rss_kb();
+         }
+      }
+   }
+   else {
+      draw_gears();
+   }
+
+   if (hud) {
+      /* percentiles need a sort, so don't redo the text every frame */
+      if (t - tHud0 >= 0.5) {
+         hud_update();
+         tHud0 = t;
+      }
+      /* with several windows only the last one gets the overlay */
+      hud_draw();
+   }
+
+   tSwap = current_time();
+   backend->swap_buffers();
+
+   if (metrics_path || hud) {
+      double tDone = current_time();
+
+      metrics_record(tDone - t, tDone - tSwap,
+                     NUM_GEARS * num_windows * (stereo ? 2 : 1));
    }
 
-   draw_gears();
-   glXSwapBuffers(dpy, win);
+   if (max_inflight > 0)
+      inflight_fence_frame(t);
+   if (stream)
+      stream_end_frame();
 
    frames++;
    
@@ -348,8 +2155,26 @@ draw_frame(Display *dpy, Window win)
    if (t - tRate0 >= 5.0) {
       GLfloat seconds = t - tRate0;
       GLfloat fps = frames / seconds;
-      printf("%d frames in %3.1f seconds = %6.3f FPS\n", frames, seconds,
-             fps);
+      if (target_ms > 0.0)
+         printf("%d frames in %3.1f seconds = %6.3f FPS (scale %.2f)\n",
+                frames, seconds, fps, res_scale);
+      else if (num_windows > 1)
+         printf("%d frames in %3.1f seconds = %6.3f frames/s, each window, "
+                "%6.3f total over %d windows, RSS %ld kB "
+                "(%d processes: about %ld kB)\n",
+                frames, seconds, fps, fps * num_windows, num_windows,
+                current_rss_kb(), num_windows, num_windows * rss_one_window);
+      else
+         printf("%d frames in %3.1f seconds = %6.3f FPS\n", frames, seconds,
+                fps);
+      if (max_inflight > 0 && inflight_retired > 0) {
+         printf("  max %d frames in flight: latency %6.3f ms, "
+                "throttled %6.3f ms/frame\n", max_inflight,
+                1000.0 * inflight_latency / inflight_retired,
+                1000.0 * inflight_wait / frames);
+         inflight_retired = 0;
+         inflight_latency = inflight_wait = 0.0;
+      }
       fflush(stdout);
       tRate0 = t;
       frames = 0;
@@ -363,6 +2188,11 @@ reshape(int width, int height)
 {
    glViewport(0, 0, (GLint) width, (GLint) height);
 
+   win_width = width;
+   win_height = height;
+   if (target_ms > 0.0)
+      dynres_resize(width, height);
+
    if (stereo) {
       GLfloat w;
 
@@ -382,7 +2212,7 @@ reshape(int width, int height)
    
    glMatrixMode(GL_MODELVIEW);
    glLoadIdentity();
-   glTranslatef(0.0, 0.0, -40.0);
+   glTranslatef(0.0, 0.0, -VIEW_DISTANCE);
 }
    
 
@@ -391,9 +2221,7 @@ static void
 init(void)
 {
    static GLfloat pos[4] = { 5.0, 5.0, 10.0, 0.0 };
-   static GLfloat red[4] = { 0.8, 0.1, 0.0, 1.0 };
-   static GLfloat green[4] = { 0.0, 0.8, 0.2, 1.0 };
-   static GLfloat blue[4] = { 0.2, 0.2, 1.0, 1.0 };
+   int i;
 
    glLightfv(GL_LIGHT0, GL_POSITION, pos);
    glEnable(GL_CULL_FACE);
@@ -402,23 +2230,24 @@ init(void)
    glEnable(GL_DEPTH_TEST);
 
    /* make the gears */
-   gear1 = glGenLists(1);
-   glNewList(gear1, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, red);
-   gear(1.0, 4.0, 1.0, 20, 0.7);
-   glEndList();
-
-   gear2 = glGenLists(1);
-   glNewList(gear2, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, green);
-   gear(0.5, 2.0, 2.0, 10, 0.7);
-   glEndList();
-
-   gear3 = glGenLists(1);
-   glNewList(gear3, GL_COMPILE);
-   glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, blue);
-   gear(1.3, 2.0, 0.5, 10, 0.7);
-   glEndList();
+   if (compact) {
+      for (i = 0; i < NUM_GEARS; i++)
+         compact_add_gear(i);
+      compact_upload();
+   }
+   else {
+      for (i = 0; i < NUM_GEARS; i++) {
+         gears[i] = glGenLists(1);
+         glNewList(gears[i], GL_COMPILE);
+         glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, gear_desc[i].color);
+         if (stream)
+            pglVertexAttrib1f(GEAR_INDEX_ATTRIB, i);
+         gear(gear_desc[i].inner_radius, gear_desc[i].outer_radius,
+              gear_desc[i].width, gear_desc[i].teeth,
+              gear_desc[i].tooth_depth);
+         glEndList();
+      }
+   }
 
    glEnable(GL_NORMALIZE);
 }
@@ -472,7 +2301,8 @@ no_border( Display *dpy, Window w)
 
 /*
  * Create an RGB, double-buffered window.
- * Return the window and context handles.
+ * Return the window and context handles.  ctxRet may be NULL when the
+ * window is going to share an existing context.
  */
 static void
 make_window( Display *dpy, const char *name,
@@ -556,16 +2386,18 @@ make_window( Display *dpy, const char *name,
                               None, (char **)NULL, 0, &sizehints);
    }
 
-   ctx = glXCreateContext( dpy, visinfo, NULL, True );
-   if (!ctx) {
-      printf("Error: glXCreateContext failed\n");
-      exit(1);
-   }
-
    *winRet = win;
-   *ctxRet = ctx;
    *visRet = visinfo->visualid;
 
+   if (ctxRet) {
+      ctx = glXCreateContext( dpy, visinfo, NULL, True );
+      if (!ctx) {
+         printf("Error: glXCreateContext failed\n");
+         exit(1);
+      }
+      *ctxRet = ctx;
+   }
+
    XFree(visinfo);
 }
 
@@ -577,16 +2409,9 @@ static int
 is_glx_extension_supported(Display *dpy, const char *query)
 {
    const int scrnum = DefaultScreen(dpy);
-   const char *glx_extensions = NULL;
-   const size_t len = strlen(query);
-   const char *ptr;
 
-   if (glx_extensions == NULL) {
-      glx_extensions = glXQueryExtensionsString(dpy, scrnum);
-   }
-
-   ptr = strstr(glx_extensions, query);
-   return ((ptr != NULL) && ((ptr[len] == ' ') || (ptr[len] == '\0')));
+   return is_extension_in_string(glXQueryExtensionsString(dpy, scrnum),
+                                 query);
 }
 
 
@@ -634,6 +2459,35 @@ query_vsync(Display *dpy, GLXDrawable drawable)
    }
 }
 
+struct glx_window {
+   Window win;
+   int width, height;
+};
+
+static Display *glx_dpy;
+static struct glx_window *glx_windows;
+static GLXContext glx_ctx;
+static VisualID glx_vis_id;
+
+
+/**
+ * Remember the new size of one of several windows.  The projection is set
+ * up from it the next time the window is bound.
+ */
+static void
+glx_window_resized(Window win, int width, int height)
+{
+   int i;
+
+   for (i = 0; i < num_windows; i++) {
+      if (glx_windows[i].win == win) {
+         glx_windows[i].width = width;
+         glx_windows[i].height = height;
+      }
+   }
+}
+
+
 /**
  * Handle one X event.
  * \return NOP, EXIT or DRAW
@@ -648,7 +2502,11 @@ handle_event(Display *dpy, Window win, XEvent *event)
    case Expose:
       return DRAW;
    case ConfigureNotify:
-      reshape(event->xconfigure.width, event->xconfigure.height);
+      if (num_windows > 1)
+         glx_window_resized(event->xconfigure.window,
+                            event->xconfigure.width, event->xconfigure.height);
+      else
+         reshape(event->xconfigure.width, event->xconfigure.height);
       break;
    case KeyPress:
       {
@@ -692,6 +2550,18 @@ event_loop(Display *dpy, Window win)
       int op;
       while (!animate || XPending(dpy) > 0) {
          XEvent event;
+
+         if (quit_requested)
+            return;
+         if (XPending(dpy) == 0) {
+            /* paused: don't block in XNextEvent, so a signal is noticed */
+            struct pollfd pfd;
+
+            pfd.fd = ConnectionNumber(dpy);
+            pfd.events = POLLIN;
+            poll(&pfd, 1, 100);
+            continue;
+         }
          XNextEvent(dpy, &event);
          op = handle_event(dpy, win, &event);
          if (op == EXIT)
@@ -700,10 +2570,327 @@ event_loop(Display *dpy, Window win)
             break;
       }
 
-      draw_frame(dpy, win);
+      if (quit_requested)
+         return;
+      draw_frame();
+   }
+}
+
+
+/*
+ * GLX backend: X windows sharing a single GLX context.
+ */
+
+static int
+glx_open(const char *dpyName)
+{
+   glx_dpy = XOpenDisplay(dpyName);
+   if (!glx_dpy) {
+      printf("Error: couldn't open display %s\n",
+	     dpyName ? dpyName : getenv("DISPLAY"));
+      return 0;
+   }
+   return 1;
+}
+
+static void
+glx_make_current_window(const char *name, int x, int y,
+                        unsigned int *width, unsigned int *height)
+{
+   /* Lay multiple windows out in a roughly square grid.  They all go on
+    * the default screen: a GLX context can't span X screens, and one
+    * context per screen would mean building every GL object once for
+    * each of them.
+    */
+   int cols = 1, rows;
+   int i;
+
+   while (cols * cols < num_windows)
+      cols++;
+   rows = (num_windows + cols - 1) / cols;
+
+   if (fullscreen) {
+      int scrnum = DefaultScreen(glx_dpy);
+
+      x = 0; y = 0;
+      *width = DisplayWidth(glx_dpy, scrnum) / cols;
+      *height = DisplayHeight(glx_dpy, scrnum) / rows;
+   }
+
+   glx_windows = calloc(num_windows, sizeof(*glx_windows));
+   for (i = 0; i < num_windows; i++) {
+      struct glx_window *w = &glx_windows[i];
+
+      make_window(glx_dpy, name,
+                  x + (i % cols) * *width, y + (i / cols) * *height,
+                  *width, *height,
+                  &w->win, i == 0 ? &glx_ctx : NULL, &glx_vis_id);
+      w->width = *width;
+      w->height = *height;
+      XMapWindow(glx_dpy, w->win);
+   }
+   glXMakeCurrent(glx_dpy, glx_windows[0].win, glx_ctx);
+}
+
+static void
+glx_bind_window(int i)
+{
+   const struct glx_window *w = &glx_windows[i];
+
+   glXMakeCurrent(glx_dpy, w->win, glx_ctx);
+   reshape(w->width, w->height);
+}
+
+static void
+glx_query_vsync(void)
+{
+   query_vsync(glx_dpy, glx_windows[0].win);
+}
+
+static void
+glx_print_info(void)
+{
+   printf("VisualID %d, 0x%x\n", (int) glx_vis_id, (int) glx_vis_id);
+}
+
+static glproc
+glx_get_proc_address(const char *name)
+{
+   return glXGetProcAddressARB((const GLubyte *) name);
+}
+
+static void
+glx_swap_buffers(void)
+{
+   int i;
+
+   for (i = 0; i < num_windows; i++)
+      glXSwapBuffers(glx_dpy, glx_windows[i].win);
+}
+
+static void
+glx_event_loop(void)
+{
+   event_loop(glx_dpy, glx_windows[0].win);
+}
+
+static void
+glx_close(void)
+{
+   int i;
+
+   glXMakeCurrent(glx_dpy, None, NULL);
+   glXDestroyContext(glx_dpy, glx_ctx);
+   for (i = 0; i < num_windows; i++)
+      XDestroyWindow(glx_dpy, glx_windows[i].win);
+   free(glx_windows);
+   XCloseDisplay(glx_dpy);
+}
+
+static const struct backend glx_backend = {
+   "glx",
+   glx_open,
+   glx_make_current_window,
+   glx_bind_window,
+   glx_query_vsync,
+   glx_print_info,
+   glx_get_proc_address,
+   glx_swap_buffers,
+   glx_event_loop,
+   glx_close
+};
+
+
+/*
+ * EGL backend: a pbuffer on the Mesa surfaceless platform.  This needs no
+ * X server at all (llvmpipe or a render node does the work), so it's what
+ * to use on headless machines.  There's nothing to present to, so frames
+ * are simply finished and the loop runs until SIGINT or SIGTERM.  The
+ * binary still links libX11, libXext and libGL for the GLX backend, so
+ * those client libraries have to be installed even where no X runs.
+ */
+static EGLDisplay egl_dpy;
+static EGLConfig egl_config;
+static EGLContext egl_ctx;
+static EGLSurface egl_surf;
+
+static int
+egl_open(const char *dpyName)
+{
+   PFNEGLGETPLATFORMDISPLAYEXTPROC pglGetPlatformDisplayEXT;
+   const char *client_exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+   EGLint major, minor;
+
+   (void) dpyName;
+
+   if (!is_extension_in_string(client_exts, "EGL_EXT_platform_base")) {
+      printf("Error: EGL_EXT_platform_base not supported\n");
+      return 0;
+   }
+   if (!is_extension_in_string(client_exts, "EGL_MESA_platform_surfaceless")) {
+      printf("Error: EGL_MESA_platform_surfaceless not supported\n");
+      return 0;
+   }
+
+   pglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+   if (!pglGetPlatformDisplayEXT) {
+      printf("Error: eglGetPlatformDisplayEXT not found\n");
+      return 0;
+   }
+   egl_dpy = pglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+                                      EGL_DEFAULT_DISPLAY, NULL);
+   if (egl_dpy == EGL_NO_DISPLAY || !eglInitialize(egl_dpy, &major, &minor)) {
+      printf("Error: couldn't initialize EGL surfaceless display\n");
+      return 0;
+   }
+
+   if (!eglBindAPI(EGL_OPENGL_API)) {
+      printf("Error: EGL doesn't support desktop OpenGL\n");
+      return 0;
+   }
+   return 1;
+}
+
+static void
+egl_make_current_window(const char *name, int x, int y,
+                        unsigned int *width, unsigned int *height)
+{
+   static const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 1,
+      EGL_GREEN_SIZE, 1,
+      EGL_BLUE_SIZE, 1,
+      EGL_DEPTH_SIZE, 1,
+      EGL_NONE
+   };
+   EGLConfig configs[64];
+   EGLint surf_attribs[5];
+   EGLint n = 0, i;
+
+   (void) name;
+   (void) x;
+   (void) y;
+
+   if (stereo || samples > 0 || num_windows > 1) {
+      printf("Error: -stereo, -samples and -windows are not supported "
+             "with -egl\n");
+      exit(1);
+   }
+
+   if (!eglChooseConfig(egl_dpy, config_attribs, configs, 64, &n) ||
+       n == 0) {
+      printf("Error: couldn't get an RGB pbuffer EGL config\n");
+      exit(1);
+   }
+
+   /* EGL sorts deeper color buffers first; prefer plain 8-bit RGB like the
+    * X visuals glXChooseVisual would give us.
+    */
+   egl_config = configs[0];
+   for (i = 0; i < n; i++) {
+      EGLint red;
+
+      eglGetConfigAttrib(egl_dpy, configs[i], EGL_RED_SIZE, &red);
+      if (red == 8) {
+         egl_config = configs[i];
+         break;
+      }
+   }
+
+   surf_attribs[0] = EGL_WIDTH;
+   surf_attribs[1] = *width;
+   surf_attribs[2] = EGL_HEIGHT;
+   surf_attribs[3] = *height;
+   surf_attribs[4] = EGL_NONE;
+   egl_surf = eglCreatePbufferSurface(egl_dpy, egl_config, surf_attribs);
+   if (egl_surf == EGL_NO_SURFACE) {
+      printf("Error: eglCreatePbufferSurface failed\n");
+      exit(1);
+   }
+
+   egl_ctx = eglCreateContext(egl_dpy, egl_config, EGL_NO_CONTEXT, NULL);
+   if (egl_ctx == EGL_NO_CONTEXT) {
+      printf("Error: eglCreateContext failed\n");
+      exit(1);
    }
+
+   eglMakeCurrent(egl_dpy, egl_surf, egl_surf, egl_ctx);
+}
+
+static void
+egl_bind_window(int i)
+{
+   /* there's only ever the one pbuffer */
+   (void) i;
+}
+
+static void
+egl_query_vsync(void)
+{
+   /* pbuffers are never synchronized to anything */
+}
+
+static void
+egl_print_info(void)
+{
+   EGLint id;
+
+   eglGetConfigAttrib(egl_dpy, egl_config, EGL_CONFIG_ID, &id);
+   printf("EGL_VERSION   = %s\n", eglQueryString(egl_dpy, EGL_VERSION));
+   printf("EGLConfig %d, 0x%x\n", (int) id, (int) id);
+}
+
+static glproc
+egl_get_proc_address(const char *name)
+{
+   return eglGetProcAddress(name);
+}
+
+static void
+egl_swap_buffers(void)
+{
+   /* eglSwapBuffers is a no-op on a pbuffer; wait for the frame instead
+    * so the driver can't queue up work indefinitely, unless the fences
+    * from -max-inflight are already taking care of that.
+    */
+   if (max_inflight > 0)
+      glFlush();
+   else
+      glFinish();
+}
+
+static void
+egl_event_loop(void)
+{
+   /* no window to close, so this only ends on ^C or kill */
+   while (!quit_requested)
+      draw_frame();
+}
+
+static void
+egl_close(void)
+{
+   eglMakeCurrent(egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+   eglDestroyContext(egl_dpy, egl_ctx);
+   eglDestroySurface(egl_dpy, egl_surf);
+   eglTerminate(egl_dpy);
 }
 
+static const struct backend egl_backend = {
+   "egl",
+   egl_open,
+   egl_make_current_window,
+   egl_bind_window,
+   egl_query_vsync,
+   egl_print_info,
+   egl_get_proc_address,
+   egl_swap_buffers,
+   egl_event_loop,
+   egl_close
+};
+
 
 static void
 usage(void)
@@ -715,6 +2902,15 @@ usage(void)
    printf("  -fullscreen             run in fullscreen mode\n");
    printf("  -info                   display OpenGL renderer info\n");
    printf("  -geometry WxH+X+Y       window geometry\n");
+   printf("  -target-ms T            scale render resolution to hold T ms per frame\n");
+   printf("  -egl                    render offscreen via EGL, no X server needed\n"
+          "                          (the X and GLX client libraries still are)\n");
+   printf("  -windows N              draw N windows on the default screen with one context\n");
+   printf("  -max-inflight N         queue at most N frames, report latency\n");
+   printf("  -stream                 stream gear transforms through a buffer\n");
+   printf("  -compact                draw gears from quantized, indexed vertex buffers\n");
+   printf("  -metrics PATH           serve statistics on Unix socket PATH\n");
+   printf("  -hud                    show statistics in the window\n");
 }
  
 
@@ -723,14 +2919,12 @@ main(int argc, char *argv[])
 {
    unsigned int winWidth = 300, winHeight = 300;
    int x = 0, y = 0;
-   Display *dpy;
-   Window win;
-   GLXContext ctx;
    char *dpyName = NULL;
    GLboolean printInfo = GL_FALSE;
-   VisualID visId;
    int i;
 
+   backend = &glx_backend;
+
    for (i = 1; i < argc; i++) {
       if (strcmp(argv[i], "-display") == 0) {
          dpyName = argv[i+1];
@@ -753,57 +2947,95 @@ main(int argc, char *argv[])
          XParseGeometry(argv[i+1], &x, &y, &winWidth, &winHeight);
          i++;
       }
+      else if (i < argc-1 && strcmp(argv[i], "-target-ms") == 0) {
+         target_ms = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-windows") == 0) {
+         num_windows = atoi(argv[i+1]);
+         if (num_windows < 1)
+            num_windows = 1;
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-max-inflight") == 0) {
+         max_inflight = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-stream") == 0) {
+         stream = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-compact") == 0) {
+         compact = GL_TRUE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-metrics") == 0) {
+         metrics_path = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-hud") == 0) {
+         hud = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-egl") == 0) {
+         backend = &egl_backend;
+      }
       else {
          usage();
          return -1;
       }
    }
 
-   dpy = XOpenDisplay(dpyName);
-   if (!dpy) {
-      printf("Error: couldn't open display %s\n",
-	     dpyName ? dpyName : getenv("DISPLAY"));
+   if (!backend->open(dpyName))
       return -1;
-   }
 
-   if (fullscreen) {
-      int scrnum = DefaultScreen(dpy);
-
-      x = 0; y = 0;
-      winWidth = DisplayWidth(dpy, scrnum);
-      winHeight = DisplayHeight(dpy, scrnum);
-   }
-
-   make_window(dpy, "glxgears", x, y, winWidth, winHeight, &win, &ctx, &visId);
-   XMapWindow(dpy, win);
-   glXMakeCurrent(dpy, win, ctx);
-   query_vsync(dpy, win);
+   backend->make_current_window("glxgears", x, y, &winWidth, &winHeight);
+   backend->query_vsync();
 
    if (printInfo) {
       printf("GL_RENDERER   = %s\n", (char *) glGetString(GL_RENDERER));
       printf("GL_VERSION    = %s\n", (char *) glGetString(GL_VERSION));
       printf("GL_VENDOR     = %s\n", (char *) glGetString(GL_VENDOR));
       printf("GL_EXTENSIONS = %s\n", (char *) glGetString(GL_EXTENSIONS));
-      printf("VisualID %d, 0x%x\n", (int) visId, (int) visId);
+      backend->print_info();
    }
 
+   if (compact)
+      compact_init();
+   if (stream)
+      stream_init();
+
    init();
 
+   if (target_ms > 0.0)
+      dynres_init();
+   if (max_inflight > 0)
+      inflight_init();
+   if (metrics_path)
+      metrics_init();
+
    /* Set initial projection/viewing transformation.
     * We can't be sure we'll get a ConfigureNotify event when the window
     * first appears.
     */
    reshape(winWidth, winHeight);
 
-   event_loop(dpy, win);
-
-   glDeleteLists(gear1, 1);
-   glDeleteLists(gear2, 1);
-   glDeleteLists(gear3, 1);
-   glXMakeCurrent(dpy, None, NULL);
-   glXDestroyContext(dpy, ctx);
-   XDestroyWindow(dpy, win);
-   XCloseDisplay(dpy);
+   /* stop cleanly when killed, so e.g. the metrics socket is removed */
+   signal(SIGINT, request_quit);
+   signal(SIGTERM, request_quit);
+
+   backend->event_loop();
+
+   for (i = 0; i < NUM_GEARS; i++)
+      glDeleteLists(gears[i], 1);
+   if (target_ms > 0.0)
+      dynres_fini();
+   if (max_inflight > 0)
+      inflight_fini();
+   if (stream)
+      stream_fini();
+   if (compact)
+      compact_fini();
+   if (metrics_path)
+      metrics_fini();
+   backend->close();
 
    return 0;
 }